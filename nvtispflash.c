@@ -17,6 +17,8 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -27,10 +29,19 @@
 #include <getopt.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <fcntl.h>
 #include <termios.h>
+#include <ctype.h>
+#include <time.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <errno.h>
 #include <err.h>
+#include <pthread.h>
+#include <linux/gpio.h>
 #include <libserialport.h>
 
 #include "nvtispflash.h"
@@ -38,6 +49,22 @@
 /* Default timeout for reading and writing commands */
 #define SERIAL_TIMEOUT 5000
 
+/* Number of outstanding connect attempts whose ack is accepted */
+#define CONNECT_ATTEMPTS 8
+
+/* Default connect timeout in audit mode, in ms */
+#define AUDIT_CONNECT_TIMEOUT 5000
+
+/* How long the power stays off when power cycling through a GPIO, and
+ * how long reset is asserted, in ms */
+#define POWER_OFF_TIME 100
+#define RESET_TIME 1
+
+/* Default timeout of a dialog expect step, in ms, and the size of the
+ * receive buffer it searches */
+#define DIALOG_TIMEOUT 1000
+#define DIALOG_BUF_SIZE 1024
+
 /* LDROM/APROM sizes, from LDSIZE config bits, for N76003 */
 static const struct {
 	int ldrom_size;
@@ -47,6 +74,153 @@ static const struct {
 	{ 3, 15 }, { 2, 16 }, { 1, 17 }, { 0, 18 }
 };
 
+static long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Event stream to a local dashboard, as JSON datagrams sent to a Unix
+ * socket. Sending never blocks: when the listener lags, is gone, or
+ * its socket buffer is full, events are dropped and counted, and the
+ * count is carried by the next event. The phase and port are those of
+ * the main flow, to report a failure on exit. */
+static struct {
+	int fd;
+	struct sockaddr_un addr;
+	atomic_uint seq;
+	atomic_uint dropped;
+	const char *port;
+	const char *phase;
+	bool verdict;
+} events = {
+	.fd = -1,
+};
+
+/* Write a JSON string into buf, escaping like print_json_string().
+ * Returns its length, or -ENOSPC if it doesn't fit. */
+static int format_json_string(char *buf, size_t size, const char *str)
+{
+	size_t len = 0;
+	int n;
+
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			n = snprintf(buf + len, size - len, "\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			n = snprintf(buf + len, size - len, "\\u%04x", *str);
+		else
+			n = snprintf(buf + len, size - len, "%c", *str);
+
+		if (n >= size - len)
+			return -ENOSPC;
+		len += n;
+	}
+
+	return len;
+}
+
+/* Events that don't fit in the buffer are dropped too, rather than
+ * sent truncated. */
+static void send_event(const char *port, const char *fmt, ...)
+{
+	char buf[512];
+	unsigned int seq;
+	unsigned int dropped;
+	va_list ap;
+	size_t len;
+	int n;
+
+	if (events.fd == -1)
+		return;
+
+	seq = atomic_fetch_add(&events.seq, 1);
+	dropped = atomic_load(&events.dropped);
+
+	n = snprintf(buf, sizeof(buf), "{\"seq\":%u,\"time_ms\":%ld,\"port\":\"",
+		     seq, now_ms());
+	if (n >= sizeof(buf))
+		goto drop;
+	len = n;
+
+	n = format_json_string(buf + len, sizeof(buf) - len, port);
+	if (n < 0)
+		goto drop;
+	len += n;
+
+	n = snprintf(buf + len, sizeof(buf) - len, "\",\"dropped\":%u,", dropped);
+	if (n >= sizeof(buf) - len)
+		goto drop;
+	len += n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf + len, sizeof(buf) - len, fmt, ap);
+	va_end(ap);
+	if (n >= sizeof(buf) - len)
+		goto drop;
+	len += n;
+
+	n = snprintf(buf + len, sizeof(buf) - len, "}\n");
+	if (n >= sizeof(buf) - len)
+		goto drop;
+	len += n;
+
+	if (sendto(events.fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL,
+		   (struct sockaddr *)&events.addr, sizeof(events.addr)) == len)
+		return;
+
+drop:
+	atomic_fetch_add(&events.dropped, 1);
+}
+
+/* Start a phase of the main flow */
+static void event_phase(const char *phase)
+{
+	events.phase = phase;
+	send_event(events.port, "\"event\":\"phase\",\"phase\":\"%s\"", phase);
+}
+
+/* End a phase of the main flow, with its duration */
+static void event_phase_done(long start)
+{
+	send_event(events.port, "\"event\":\"phase_done\",\"phase\":\"%s\",\"duration_ms\":%ld",
+		   events.phase, now_ms() - start);
+}
+
+static void event_verdict(const char *port, bool pass, const char *phase)
+{
+	if (pass)
+		send_event(port, "\"event\":\"verdict\",\"result\":\"pass\"");
+	else
+		send_event(port, "\"event\":\"verdict\",\"result\":\"fail\",\"phase\":\"%s\"",
+			   phase);
+}
+
+/* The main flow bails out on errors. Report it. */
+static void event_exit(void)
+{
+	if (events.port && !events.verdict)
+		event_verdict(events.port, false, events.phase);
+}
+
+static int open_events(const char *path)
+{
+	if (strlen(path) >= sizeof(events.addr.sun_path))
+		return -ENAMETOOLONG;
+
+	events.fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (events.fd == -1)
+		return -errno;
+
+	events.addr.sun_family = AF_UNIX;
+	strcpy(events.addr.sun_path, path);
+
+	return 0;
+}
+
 /* Compute the sum of all bytes of a command. The response checksum
  * must match it. */
 static uint32_t calc_checksum(const struct pkt_cmd *cmd)
@@ -79,39 +253,64 @@ static int send_cmd(struct dev *dev, struct pkt_cmd *cmd)
 	return 0;
 }
 
-static int read_response(struct dev *dev, int timeout_ms)
+/* Read the response to the last command into ack */
+static int read_response(struct dev *dev, struct pkt_ack *ack, int timeout_ms)
 {
 	int rc;
-	void *p = &dev->ack;
-	int len = sizeof(dev->ack);
+	void *p = ack;
+	int len = sizeof(*ack);
 
-	if (timeout_ms)
-		rc = sp_blocking_read(dev->sp, p, len, timeout_ms);
-	else
-		rc = sp_nonblocking_read(dev->sp, p, len);
-	if (rc == len) {
-		if (dev->ack.pkt_num != dev->pkt_num) {
-			printf("bad reply pkt_num: %u vs. %u\n", dev->ack.pkt_num, dev->pkt_num);
+	while (1) {
+		if (timeout_ms)
+			rc = sp_blocking_read(dev->sp, p, len, timeout_ms);
+		else
+			rc = sp_nonblocking_read(dev->sp, p, len);
+		if (rc != len)
+			return -ETIMEDOUT;
+
+		/* Late ack to an earlier command, such as a connect
+		 * attempt. Skip it. */
+		if ((int32_t)(ack->pkt_num - dev->pkt_num) < 0)
+			continue;
+
+		if (ack->pkt_num != dev->pkt_num) {
+			fprintf(stderr, "bad reply pkt_num: %u vs. %u\n",
+				ack->pkt_num, dev->pkt_num);
 			return -EIO;
 		}
 
-		if (dev->ack.checksum != dev->checksum) {
-			printf("bad checksum %x vs %x\n", dev->ack.checksum, dev->checksum);
+		if (ack->checksum != dev->checksum) {
+			fprintf(stderr, "bad checksum %x vs %x\n",
+				ack->checksum, dev->checksum);
 			return -EIO;
 		}
 
 		return 0;
 	}
-
-	return -ETIMEDOUT;
 }
 
 /* Initiate connection to device. Issue the connect command every 40ms
- * until the device respond. */
+ * until the device respond, or the connect timeout expires.
+ *
+ * With a slow adapter, the ack to an attempt may only arrive after
+ * the next attempt has been sent, so an ack to any of the last
+ * CONNECT_ATTEMPTS attempts is accepted. The packet numbers are
+ * re-synced afterwards by dev_sync_packno(). */
 static int dev_connect(struct dev *dev)
 {
+	struct {
+		uint32_t pkt_num;
+		uint32_t checksum;
+	} attempts[CONNECT_ATTEMPTS];
 	struct pkt_cmd cmd = {};
+	struct pkt_ack ack;
+	int timeout = dev->job->connect_timeout;
+	int num_attempts = 0;
+	int elapsed = 0;
+	int carried;
+	int len = 0;
 	int rc;
+	int i;
 
 	cmd.cmd = CMD_CONNECT;
 
@@ -121,19 +320,49 @@ static int dev_connect(struct dev *dev)
 		if (rc)
 			return rc;
 
+		/* Remember the ack this attempt expects */
+		i = num_attempts++ % CONNECT_ATTEMPTS;
+		attempts[i].pkt_num = dev->pkt_num;
+		attempts[i].checksum = dev->checksum;
+
 		/* NuMicro manual says 40ms between each tries */
 		usleep(40000);
+		elapsed += 40;
 
-		rc = read_response(dev, 0);
-		if (rc == 0)
-			break;
-	}
+		/* Go through all the acks received so far. An ack may
+		 * be split across two cycles. */
+		carried = len;
+		while (1) {
+			rc = sp_nonblocking_read(dev->sp, (uint8_t *)&ack + len,
+						 sizeof(ack) - len);
+			if (rc <= 0)
+				break;
+
+			len += rc;
+			if (len < sizeof(ack))
+				continue;
+			len = 0;
+
+			for (i = 0; i < CONNECT_ATTEMPTS && i < num_attempts; i++)
+				if (ack.pkt_num == attempts[i].pkt_num &&
+				    ack.checksum == attempts[i].checksum)
+					return 0;
+		}
 
-	return rc;
+		/* An ack that didn't progress during a whole cycle is
+		 * garbage. Drop it to get back in sync. */
+		if (len && len == carried)
+			len = 0;
+
+		if (timeout && elapsed >= timeout)
+			return -ETIMEDOUT;
+	}
 }
 
-/* Several commands don't have parameters, so share some code. */
-static int generic_command(struct dev *dev, uint32_t opcode)
+/* Several commands don't have parameters, so share some code. The
+ * response is returned in ack. */
+static int generic_command(struct dev *dev, uint32_t opcode,
+			   struct pkt_ack *ack)
 {
 	struct pkt_cmd cmd = {
 		.cmd = opcode
@@ -144,7 +373,7 @@ static int generic_command(struct dev *dev, uint32_t opcode)
 	if (rc)
 		return rc;
 
-	rc = read_response(dev, SERIAL_TIMEOUT);
+	rc = read_response(dev, ack, SERIAL_TIMEOUT);
 	if (rc)
 		return rc;
 
@@ -154,6 +383,7 @@ static int generic_command(struct dev *dev, uint32_t opcode)
 static int dev_sync_packno(struct dev *dev)
 {
 	struct pkt_cmd cmd = {};
+	struct pkt_ack ack;
 	int rc;
 
 	cmd.cmd = CMD_SYNC_PACKNO;
@@ -163,7 +393,7 @@ static int dev_sync_packno(struct dev *dev)
 	if (rc)
 		return rc;
 
-	rc = read_response(dev, SERIAL_TIMEOUT);
+	rc = read_response(dev, &ack, SERIAL_TIMEOUT);
 	if (rc)
 		return rc;
 
@@ -186,6 +416,14 @@ static int dev_reset(struct dev *dev)
 	return 0;
 }
 
+/* Erase the whole APROM. The device only acks once done. */
+static int dev_erase_all(struct dev *dev)
+{
+	struct pkt_ack ack;
+
+	return generic_command(dev, CMD_ERASE_ALL, &ack);
+}
+
 static int dev_run_aprom(struct dev *dev)
 {
 	struct pkt_cmd cmd = {
@@ -195,6 +433,195 @@ static int dev_run_aprom(struct dev *dev)
 	return send_cmd(dev, &cmd);
 }
 
+/* Try to automatically reset the device. Move DTR to low then
+ * high. This will not work if DTR is not connected or the RPD config
+ * bit is not set to 1. */
+static void dev_pulse_dtr(struct dev *dev)
+{
+	sp_set_dtr(dev->sp, SP_DTR_ON);
+	usleep(1000);
+	sp_set_dtr(dev->sp, SP_DTR_OFF);
+}
+
+/* Request a GPIO line as an output, from a chip:line[:invert]
+ * specification. The chip is either a path or a name under /dev. A
+ * logical value of 1 means reset asserted, or power on. The reset line
+ * is active low, unless inverted. */
+static int gpio_request(const char *spec, bool active_low, int value, int *fd)
+{
+	struct gpio_v2_line_request req = {};
+	char chip[64];
+	char *line;
+	char *end;
+	int chip_fd;
+	int rc;
+
+	if (snprintf(chip, sizeof(chip), "%s%s", strchr(spec, '/') ? "" : "/dev/",
+		     spec) >= sizeof(chip))
+		return -EINVAL;
+
+	line = strrchr(chip, ':');
+	if (line && strcmp(line, ":invert") == 0) {
+		active_low = !active_low;
+		*line = '\0';
+		line = strrchr(chip, ':');
+	}
+	if (line == NULL)
+		return -EINVAL;
+	*line++ = '\0';
+
+	req.offsets[0] = strtoul(line, &end, 0);
+	if (*line == '\0' || *end != '\0')
+		return -EINVAL;
+
+	req.num_lines = 1;
+	strncpy(req.consumer, "nvtispflash", sizeof(req.consumer) - 1);
+	req.config.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+	if (active_low)
+		req.config.flags |= GPIO_V2_LINE_FLAG_ACTIVE_LOW;
+
+	/* Don't glitch the line when requesting it */
+	req.config.num_attrs = 1;
+	req.config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+	req.config.attrs[0].attr.values = value;
+	req.config.attrs[0].mask = 1;
+
+	chip_fd = open(chip, O_RDONLY);
+	if (chip_fd == -1)
+		return -errno;
+
+	rc = ioctl(chip_fd, GPIO_V2_GET_LINE_IOCTL, &req);
+	if (rc == -1)
+		rc = -errno;
+	close(chip_fd);
+	if (rc)
+		return rc;
+
+	*fd = req.fd;
+
+	return 0;
+}
+
+static int gpio_set(int fd, int value)
+{
+	struct gpio_v2_line_values values = {
+		.bits = value,
+		.mask = 1,
+	};
+
+	if (ioctl(fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &values) == -1)
+		return -errno;
+
+	return 0;
+}
+
+/* Request the reset and power GPIO lines, if any. They are left
+ * released, and the power on. */
+static int open_gpios(struct job *job)
+{
+	int rc;
+
+	if (job->reset_gpio) {
+		rc = gpio_request(job->reset_gpio, true, 0, &job->reset_fd);
+		if (rc)
+			return rc;
+	}
+
+	if (job->power_gpio) {
+		rc = gpio_request(job->power_gpio, false, 1, &job->power_fd);
+		if (rc)
+			return rc;
+	}
+
+	return 0;
+}
+
+/* Reset the board through the GPIO lines: hold it in reset, power
+ * cycle it, then release the reset. The LDROM starts right away, so
+ * this must be followed immediately by dev_connect(). */
+static int gpio_reset(const struct job *job)
+{
+	int rc;
+
+	if (job->reset_gpio) {
+		rc = gpio_set(job->reset_fd, 1);
+		if (rc)
+			return rc;
+	}
+
+	if (job->power_gpio) {
+		rc = gpio_set(job->power_fd, 0);
+		if (rc)
+			return rc;
+		usleep(POWER_OFF_TIME * 1000);
+
+		rc = gpio_set(job->power_fd, 1);
+		if (rc)
+			return rc;
+	}
+
+	if (job->reset_gpio) {
+		usleep(RESET_TIME * 1000);
+		rc = gpio_set(job->reset_fd, 0);
+		if (rc)
+			return rc;
+	}
+
+	return 0;
+}
+
+/* Connect to the device and retrieve its identity and config, using
+ * only read-only commands. On error, what failed is returned in
+ * errmsg. */
+static int dev_identify(struct dev *dev, const char **errmsg)
+{
+	struct pkt_ack ack;
+	int rc;
+
+	rc = dev_connect(dev);
+	if (rc) {
+		*errmsg = "Can't connect to device";
+		return rc;
+	}
+
+	rc = dev_sync_packno(dev);
+	if (rc) {
+		*errmsg = "Can't sync packet numbers";
+		return rc;
+	}
+
+	rc = generic_command(dev, CMD_GET_FWVER, &ack);
+	if (rc) {
+		*errmsg = "Can't get FW version";
+		return rc;
+	}
+	dev->fwver = ack.get_fwver.version;
+
+	rc = generic_command(dev, CMD_GET_DEVICEID, &ack);
+	if (rc) {
+		*errmsg = "Can't get device ID";
+		return rc;
+	}
+	dev->deviceid = ack.get_deviceid.deviceid;
+
+	rc = generic_command(dev, CMD_READ_CONFIG, &ack);
+	if (rc) {
+		*errmsg = "Can't read config";
+		return rc;
+	}
+	dev->config_current = ack.read_config;
+
+	return 0;
+}
+
+static const char *device_name(uint32_t deviceid)
+{
+	switch (deviceid) {
+	case 0x3650: return "N76E003";
+	default: return NULL;
+	}
+}
+
 static void decode_config(const union config_bytes *config)
 {
 	printf("Config:\n");
@@ -213,47 +640,50 @@ static void decode_config(const union config_bytes *config)
 	printf("  WDTEN:%u\n", config->wdten);
 }
 
-int set_new_config_options(struct dev *dev)
+/* Compute the config to program, from the current config and the
+ * bits set by the command line. Return whether it differs from the
+ * current config. */
+static bool stage_config(const struct dev *dev, union config_bytes *config)
 {
-	union config_bytes config_update;
-	struct pkt_cmd cmd = {};
+	const struct job *job = dev->job;
 	bool changes = false;
-	int rc;
 	int i;
 
 	for (i = 0; i < sizeof(union config_bytes); i++) {
-		config_update.raw[i] = dev->config_current.raw[i] & ~dev->config_mask.raw[i];
-		config_update.raw[i] |= dev->config_new.raw[i];
+		config->raw[i] = dev->config_current.raw[i] & ~job->config_mask.raw[i];
+		config->raw[i] |= job->config_new.raw[i];
 
-		if (config_update.raw[i] != dev->config_current.raw[i])
+		if (config->raw[i] != dev->config_current.raw[i])
 			changes = true;
 	}
 
-	/* Avoid programming the config bits if nothing has
-	 * changed. This is not an error. */
-	if (!changes) {
-		printf("No config changes\n");
-		return 0;
-	}
+	return changes;
+}
+
+int set_new_config_options(struct dev *dev, const union config_bytes *config)
+{
+	struct pkt_cmd cmd = {};
+	struct pkt_ack ack;
+	int rc;
 
 	/* Program the new config */
 	cmd.cmd = CMD_UPDATE_CONFIG;
-	cmd.update_config.new = config_update;
+	cmd.update_config.new = *config;
 
 	rc = send_cmd(dev, &cmd);
 	if (rc)
 		return rc;
 
-	rc = read_response(dev, SERIAL_TIMEOUT);
+	rc = read_response(dev, &ack, SERIAL_TIMEOUT);
 	if (rc)
 		return rc;
 
 	/* Read the new config */
-	rc = generic_command(dev, CMD_READ_CONFIG);
+	rc = generic_command(dev, CMD_READ_CONFIG, &ack);
 	if (rc)
 		return -EIO;
 
-	dev->config_current = dev->ack.read_config;
+	dev->config_current = ack.read_config;
 
 	printf("New config options:\n");
 	decode_config(&dev->config_current);
@@ -261,47 +691,136 @@ int set_new_config_options(struct dev *dev)
 	return 0;
 }
 
-static int dev_update_aprom(struct dev *dev)
+/* Read the APROM file. This is done before connecting to the device,
+ * so a bad file is reported before the board is reset. The image is a
+ * private copy, so the file changing while flashing can't affect it. */
+static int load_aprom_file(struct job *job)
 {
-	int fd;
 	struct stat statbuf;
-	char buf[18 * 1024];
-	bool first = true;
-	int total_length;
-	int to_copy;
+	uint8_t *buf;
+	ssize_t len;
+	int done;
 	int rc;
-	void *p;
+	int fd;
 
-	fd = open(dev->aprom_file, O_RDONLY);
+	fd = open(job->aprom_file, O_RDONLY);
 	if (fd == -1)
 		return -errno;
 
 	rc = fstat(fd, &statbuf);
-	if (rc == -1)
-		return -errno;
+	if (rc == -1) {
+		rc = -errno;
+		close(fd);
+		return rc;
+	}
 
-	if (statbuf.st_size == 0)
-		return -EBADF;
+	/* Check against the largest possible APROM for now. The actual
+	 * size is only known once the config has been read. */
+	if (statbuf.st_size == 0 || statbuf.st_size > APROM_MAX) {
+		close(fd);
+		return statbuf.st_size ? -E2BIG : -EBADF;
+	}
 
-	if (statbuf.st_size > dev->aprom_size)
-		return -E2BIG;
+	buf = malloc(statbuf.st_size);
+	if (buf == NULL) {
+		close(fd);
+		return -ENOMEM;
+	}
 
-	/* TODO: loop until all read, or use mmap instead. */
-	rc = read(fd, buf, statbuf.st_size);
-	if (rc != statbuf.st_size)
-		return -EIO;
+	for (done = 0; done < statbuf.st_size; done += len) {
+		len = read(fd, buf + done, statbuf.st_size - done);
+		if (len <= 0) {
+			rc = len ? -errno : -EIO;
+			free(buf);
+			close(fd);
+			return rc;
+		}
+	}
 
-	p = buf;
-	total_length = statbuf.st_size;
+	close(fd);
+
+	job->aprom = buf;
+	job->aprom_len = statbuf.st_size;
+
+	return 0;
+}
+
+static void unload_aprom_file(struct job *job)
+{
+	free((void *)job->aprom);
+	job->aprom = NULL;
+}
+
+/* Split the APROM file into segments, around the pages holding a
+ * preserved range. The file may only cover these pages with 0xff
+ * bytes, i.e. padding. */
+static int plan_aprom_segments(struct job *job)
+{
+	bool preserved[APROM_MAX / FLASH_PAGE_SIZE] = {};
+	int page;
+	int addr;
+	int end;
+	int i;
+
+	for (i = 0; i < job->num_preserve; i++) {
+		end = job->preserve[i].addr + job->preserve[i].len;
+		for (addr = job->preserve[i].addr; addr < end; addr += FLASH_PAGE_SIZE)
+			preserved[addr / FLASH_PAGE_SIZE] = true;
+		preserved[(end - 1) / FLASH_PAGE_SIZE] = true;
+	}
+
+	job->num_segments = 0;
+
+	for (addr = 0; addr < job->aprom_len; addr = end) {
+		page = addr / FLASH_PAGE_SIZE;
+		end = (page + 1) * FLASH_PAGE_SIZE;
+		if (end > job->aprom_len)
+			end = job->aprom_len;
+
+		if (preserved[page]) {
+			for (i = addr; i < end; i++)
+				if (job->aprom[i] != 0xff)
+					return -EPERM;
+			continue;
+		}
+
+		/* Extend the current segment, or start a new one */
+		i = job->num_segments - 1;
+		if (i >= 0 && job->segments[i].addr + job->segments[i].len == addr) {
+			job->segments[i].len += end - addr;
+		} else {
+			i = job->num_segments++;
+			job->segments[i].addr = addr;
+			job->segments[i].len = end - addr;
+		}
+	}
+
+	return 0;
+}
+
+/* Program one segment of the APROM file, at the same address in
+ * APROM. */
+static int dev_update_aprom_segment(struct dev *dev, int addr, int len)
+{
+	const uint8_t *p;
+	bool first = true;
+	int total_length;
+	int to_copy;
+	int rc;
+
+	p = dev->job->aprom + addr;
+	total_length = len;
+	rc = 0;
 
 	while (total_length) {
 		struct pkt_cmd cmd = {};
+		struct pkt_ack ack;
 
 		if (first) {
 			first = false;
 
 			cmd.cmd = CMD_UPDATE_APROM;
-			cmd.update_aprom.start_addr = 0x0000;
+			cmd.update_aprom.start_addr = addr;
 			cmd.update_aprom.total_length = total_length;
 
 			if (total_length > sizeof(cmd.update_aprom.data))
@@ -321,51 +840,469 @@ static int dev_update_aprom(struct dev *dev)
 			memcpy(cmd.update_aprom2.data, p, to_copy);
 		}
 
-		printf("sending block of %d bytes, from offset 0x%lx\n",
-		       to_copy, (ptrdiff_t)p - (ptrdiff_t)buf);
+		printf("sending block of %d bytes, from offset 0x%tx\n",
+		       to_copy, p - dev->job->aprom);
 
 		rc = send_cmd(dev, &cmd);
 		if (rc)
-			return rc;
+			break;
 
-		rc = read_response(dev, SERIAL_TIMEOUT);
+		rc = read_response(dev, &ack, SERIAL_TIMEOUT);
 		if (rc)
-			return rc;
+			break;
 
 		total_length -= to_copy;
 		p += to_copy;
 	}
 
+	return rc;
+}
+
+static int dev_update_aprom(struct dev *dev)
+{
+	const struct job *job = dev->job;
+	int rc;
+	int i;
+
+	if (job->aprom_len > dev->aprom_size)
+		return -E2BIG;
+
+	for (i = 0; i < job->num_segments; i++) {
+		rc = dev_update_aprom_segment(dev, job->segments[i].addr,
+					      job->segments[i].len);
+		if (rc)
+			return rc;
+	}
+
 	return 0;
 }
 
-/* Open the serial device and configure it */
-static void open_serial_device(struct dev *dev)
+/* Decode the escape sequences \n, \r, \t, \\ and \xHH in place.
+ * Return the decoded length, or -1 on a bad sequence. */
+static int unescape(char *str)
+{
+	char *in = str;
+	char *out = str;
+	char hex[3] = {};
+
+	while (*in) {
+		if (*in != '\\') {
+			*out++ = *in++;
+			continue;
+		}
+
+		in++;
+		switch (*in++) {
+		case 'n': *out++ = '\n'; break;
+		case 'r': *out++ = '\r'; break;
+		case 't': *out++ = '\t'; break;
+		case '\\': *out++ = '\\'; break;
+		case 'x':
+			if (!isxdigit((unsigned char)in[0]) ||
+			    !isxdigit((unsigned char)in[1]))
+				return -1;
+			hex[0] = *in++;
+			hex[1] = *in++;
+			*out++ = strtoul(hex, NULL, 16);
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	return out - str;
+}
+
+/* Load the dialog file. Each line is a step:
+ *   send <text>      send text to the firmware
+ *   expect <text>    wait until the firmware sent that text
+ *   timeout <ms>     timeout of the following expect steps
+ *   wait <ms>        pause
+ * Empty lines and lines starting with # are ignored. */
+static int load_dialog(struct job *job)
+{
+	static const char * const keywords[] = {
+		[STEP_SEND] = "send",
+		[STEP_EXPECT] = "expect",
+		[STEP_TIMEOUT] = "timeout",
+		[STEP_WAIT] = "wait",
+	};
+	struct dialog_step *step;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	int line_num = 0;
+	char *arg;
+	FILE *f;
+	int i;
+
+	f = fopen(job->dialog_file, "r");
+	if (f == NULL)
+		return -errno;
+
+	while ((len = getline(&line, &size, f)) != -1) {
+		line_num++;
+
+		while (len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = '\0';
+
+		if (len == 0 || line[0] == '#')
+			continue;
+
+		arg = strchr(line, ' ');
+		if (arg)
+			*arg++ = '\0';
+		else
+			arg = "";
+
+		for (i = 0; i < sizeof(keywords) / sizeof(keywords[0]); i++)
+			if (strcmp(line, keywords[i]) == 0)
+				break;
+		if (i == sizeof(keywords) / sizeof(keywords[0])) {
+			fprintf(stderr, "%s:%d: unknown step '%s'\n",
+				job->dialog_file, line_num, line);
+			goto fail;
+		}
+
+		job->dialog = realloc(job->dialog,
+				      (job->num_dialog_steps + 1) * sizeof(*job->dialog));
+		if (job->dialog == NULL)
+			goto fail;
+
+		step = &job->dialog[job->num_dialog_steps++];
+		step->type = i;
+		step->line = line_num;
+		step->text = NULL;
+
+		switch (step->type) {
+		case STEP_SEND:
+		case STEP_EXPECT:
+			step->text = strdup(arg);
+			if (step->text == NULL)
+				goto fail;
+			step->len = unescape(step->text);
+			if (step->len <= 0 || step->len >= DIALOG_BUF_SIZE) {
+				fprintf(stderr, "%s:%d: invalid text\n",
+					job->dialog_file, line_num);
+				goto fail;
+			}
+			break;
+
+		case STEP_TIMEOUT:
+		case STEP_WAIT:
+			step->value = atoi(arg);
+			if (step->value <= 0) {
+				fprintf(stderr, "%s:%d: invalid duration '%s'\n",
+					job->dialog_file, line_num, arg);
+				goto fail;
+			}
+			break;
+		}
+	}
+
+	free(line);
+	fclose(f);
+
+	return 0;
+
+fail:
+	free(line);
+	fclose(f);
+
+	return -EINVAL;
+}
+
+/* Run the dialog with the freshly booted firmware, reporting the
+ * duration of each step. */
+static int run_dialog(struct dev *dev)
+{
+	char buf[DIALOG_BUF_SIZE];
+	int timeout = DIALOG_TIMEOUT;
+	const struct dialog_step *step;
+	const char *match;
+	long start;
+	long left;
+	int len = 0;
+	int rc;
+	int i;
+
+	for (i = 0; i < dev->job->num_dialog_steps; i++) {
+		step = &dev->job->dialog[i];
+		start = now_ms();
+
+		switch (step->type) {
+		case STEP_SEND:
+			rc = sp_blocking_write(dev->sp, step->text, step->len,
+					       SERIAL_TIMEOUT);
+			if (rc != step->len) {
+				printf("Dialog line %d: can't send\n", step->line);
+				return -ETIMEDOUT;
+			}
+			sp_drain(dev->sp);
+			printf("Dialog line %d: sent in %ld ms\n",
+			       step->line, now_ms() - start);
+			break;
+
+		case STEP_EXPECT:
+			while (1) {
+				match = memmem(buf, len, step->text, step->len);
+				if (match)
+					break;
+
+				left = timeout - (now_ms() - start);
+				if (left <= 0) {
+					printf("Dialog line %d: expected text not received in %d ms. Got:\n%.*s\n",
+					       step->line, timeout, len, buf);
+					return -ETIMEDOUT;
+				}
+
+				/* Make room, keeping enough for a match */
+				if (len == sizeof(buf)) {
+					memmove(buf, buf + len - step->len, step->len);
+					len = step->len;
+				}
+
+				rc = sp_blocking_read_next(dev->sp, buf + len,
+							   sizeof(buf) - len, left);
+				if (rc > 0)
+					len += rc;
+			}
+
+			/* Consume everything up to the end of the match */
+			match += step->len;
+			len -= match - buf;
+			memmove(buf, match, len);
+
+			printf("Dialog line %d: matched in %ld ms\n",
+			       step->line, now_ms() - start);
+			break;
+
+		case STEP_TIMEOUT:
+			timeout = step->value;
+			break;
+
+		case STEP_WAIT:
+			usleep(step->value * 1000);
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/* Open the serial device and configure it. On error, what failed is
+ * returned in errmsg. */
+static int open_serial_device(struct dev *dev, const char **errmsg)
 {
 	int rc;
 
 	rc = sp_get_port_by_name(dev->serial_device, &dev->sp);
-	if (rc)
-		err(EXIT_FAILURE, "Can't allocate serial port");
+	if (rc) {
+		*errmsg = "Can't allocate serial port";
+		return -ENODEV;
+	}
 
 	rc = sp_open(dev->sp, SP_MODE_READ_WRITE);
-	if (rc)
-		err(EXIT_FAILURE, "Can't open serial port %s", dev->serial_device);
+	if (rc) {
+		*errmsg = "Can't open serial port";
+		sp_free_port(dev->sp);
+		return -EIO;
+	}
 
 	if (sp_set_baudrate(dev->sp, 115200) ||
 	    sp_set_bits(dev->sp, 8) ||
 	    sp_set_parity(dev->sp, SP_PARITY_NONE) ||
 	    sp_set_stopbits(dev->sp, 1) ||
-	    sp_set_flowcontrol(dev->sp, SP_FLOWCONTROL_NONE))
-		err(EXIT_FAILURE, "Can't set a serial port setting");
+	    sp_set_flowcontrol(dev->sp, SP_FLOWCONTROL_NONE)) {
+		*errmsg = "Can't set a serial port setting";
+		sp_close(dev->sp);
+		sp_free_port(dev->sp);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/* One port of a fleet audit */
+struct audit {
+	pthread_t thread;
+	pthread_barrier_t *ready;	/* all the ports are open */
+	struct dev dev;
+	int rc;
+	const char *errmsg;
+};
+
+static void *audit_port(void *arg)
+{
+	struct audit *audit = arg;
+	struct dev *dev = &audit->dev;
+
+	audit->rc = open_serial_device(dev, &audit->errmsg);
+
+	/* With GPIO lines, the whole fixture is reset at once when
+	 * every port is ready. */
+	pthread_barrier_wait(audit->ready);
+	if (audit->rc) {
+		event_verdict(dev->serial_device, false, "open");
+		return NULL;
+	}
+
+	if (!dev->job->reset_gpio && !dev->job->power_gpio)
+		dev_pulse_dtr(dev);
+
+	audit->rc = dev_identify(dev, &audit->errmsg);
+	if (audit->rc == 0 && !dev->job->remain_isp)
+		dev_run_aprom(dev);
+
+	sp_close(dev->sp);
+	sp_free_port(dev->sp);
+
+	event_verdict(dev->serial_device, audit->rc == 0, "identify");
+
+	return NULL;
+}
+
+/* Print a JSON string, escaping what needs to be */
+static void print_json_string(const char *str)
+{
+	putchar('"');
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			printf("\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			printf("\\u%04x", *str);
+		else
+			putchar(*str);
+	}
+	putchar('"');
+}
+
+static void print_audit_json(const struct audit *audits, int num_ports)
+{
+	int i;
+	int j;
+
+	printf("{\n  \"ports\": [");
+
+	for (i = 0; i < num_ports; i++) {
+		const struct dev *dev = &audits[i].dev;
+		const union config_bytes *config = &dev->config_current;
+		const char *name;
+
+		printf("%s\n    {\n      \"port\": ", i ? "," : "");
+		print_json_string(dev->serial_device);
+
+		if (audits[i].rc) {
+			printf(",\n      \"status\": \"error\",\n      \"error\": ");
+			print_json_string(audits[i].errmsg);
+			printf("\n    }");
+			continue;
+		}
+
+		name = device_name(dev->deviceid);
+
+		printf(",\n      \"status\": \"ok\",\n");
+		printf("      \"fw_version\": \"0x%x\",\n", dev->fwver);
+		printf("      \"device_id\": \"0x%x\",\n", dev->deviceid);
+		printf("      \"chip\": ");
+		if (name)
+			print_json_string(name);
+		else
+			printf("null");
+		printf(",\n      \"config\": {\n");
+		printf("        \"raw\": \"");
+		for (j = 0; j < sizeof(config->raw); j++)
+			printf("%02x", config->raw[j]);
+		printf("\",\n");
+		printf("        \"lock\": %u,\n", config->lock);
+		printf("        \"rpd\": %u,\n", config->rpd);
+		printf("        \"ocden\": %u,\n", config->ocden);
+		printf("        \"ocdpwm\": %u,\n", config->ocdpwm);
+		printf("        \"cbs\": %u,\n", config->cbs);
+		printf("        \"ldrom_kb\": %u,\n", ldsize[config->ldsize].ldrom_size);
+		printf("        \"aprom_kb\": %u,\n", ldsize[config->ldsize].aprom_size);
+		printf("        \"cborst\": %u,\n", config->cborst);
+		printf("        \"boiap\": %u,\n", config->boiap);
+		printf("        \"cbov\": %u,\n", config->cbov);
+		printf("        \"cboden\": %u,\n", config->cboden);
+		printf("        \"wdten\": %u\n", config->wdten);
+		printf("      }\n    }");
+	}
+
+	printf("\n  ]\n}\n");
+}
+
+/* Identify all the devices concurrently, and print a JSON report. The
+ * devices are rebooted to APROM afterwards, unless asked to remain in
+ * ISP mode. */
+static int run_audit(const struct job *job,
+		     const char **serial_devices, int num_ports)
+{
+	struct audit *audits;
+	pthread_barrier_t ready;
+	pthread_attr_t attr;
+	int failures = 0;
+	int rc;
+	int i;
+
+	audits = calloc(num_ports, sizeof(*audits));
+	if (audits == NULL)
+		return -ENOMEM;
+
+	/* The audit needs very little stack. Keep it small so that
+	 * large fixtures don't use too much memory. */
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, 64 * 1024);
+	pthread_barrier_init(&ready, NULL, num_ports + 1);
+
+	for (i = 0; i < num_ports; i++) {
+		audits[i].ready = &ready;
+		audits[i].dev.job = job;
+		audits[i].dev.serial_device = serial_devices[i];
+		audits[i].dev.pkt_num = 0x17;
+
+		rc = pthread_create(&audits[i].thread, &attr, audit_port, &audits[i]);
+		if (rc)
+			errx(EXIT_FAILURE, "Can't create audit thread");
+	}
+
+	pthread_attr_destroy(&attr);
+
+	pthread_barrier_wait(&ready);
+	rc = gpio_reset(job);
+	if (rc)
+		warnx("Can't reset the fixture through GPIOs: %s", strerror(-rc));
+
+	for (i = 0; i < num_ports; i++) {
+		pthread_join(audits[i].thread, NULL);
+		if (audits[i].rc)
+			failures++;
+	}
+
+	pthread_barrier_destroy(&ready);
+
+	print_audit_json(audits, num_ports);
+
+	free(audits);
+
+	return failures ? -EIO : 0;
 }
 
 static const struct option long_options[] = {
 	{ "serial-device", required_argument, 0,  'd' },
 	{ "aprom-file", required_argument, 0,  'a' },
 	{ "config", required_argument, 0,  'c' },
+	{ "erase-all", no_argument, 0,  'e' },
+	{ "preserve", required_argument, 0,  'p' },
+	{ "addressed-ldrom", no_argument, 0,  'L' },
+	{ "reset-gpio", required_argument, 0,  'R' },
+	{ "power-gpio", required_argument, 0,  'P' },
 	{ "remain-isp", no_argument, 0,  'r' },
 	{ "read-serial", no_argument, 0,  's' },
+	{ "dialog", required_argument, 0,  'D' },
+	{ "audit", no_argument, 0,  'A' },
+	{ "events", required_argument, 0,  'E' },
+	{ "timeout", required_argument, 0,  't' },
 	{ "help", no_argument, 0,  'h' },
 	{ 0, 0, 0, 0 }
 };
@@ -375,7 +1312,7 @@ static char * const opt_tokens[] = {
 	NULL
 };
 
-int process_config_options(struct dev *dev)
+int process_config_options(struct job *job)
 {
 	char *subopts;
 	char *value;
@@ -408,8 +1345,8 @@ int process_config_options(struct dev *dev)
 
 		switch (opt) {
 		case OPT_RPD:
-			dev->config_new.rpd = cfg_value;
-			dev->config_mask.rpd = 1;
+			job->config_new.rpd = cfg_value;
+			job->config_mask.rpd = 1;
 			break;
 
 		default:
@@ -421,6 +1358,40 @@ int process_config_options(struct dev *dev)
 	return 0;
 }
 
+int process_preserve_option(struct job *job)
+{
+	unsigned long addr;
+	unsigned long len;
+	char *start;
+	char *end;
+
+	if (job->num_preserve == MAX_PRESERVE) {
+		fprintf(stderr, "Too many preserved ranges\n");
+		return -EINVAL;
+	}
+
+	addr = strtoul(optarg, &end, 0);
+	if (end == optarg || *end != ':') {
+		fprintf(stderr, "Invalid preserved range '%s'. Must be addr:len\n",
+			optarg);
+		return -EINVAL;
+	}
+
+	start = end + 1;
+	len = strtoul(start, &end, 0);
+	if (end == start || *end != '\0' || len == 0 ||
+	    addr >= APROM_MAX || len > APROM_MAX - addr) {
+		fprintf(stderr, "Invalid preserved range '%s'\n", optarg);
+		return -EINVAL;
+	}
+
+	job->preserve[job->num_preserve].addr = addr;
+	job->preserve[job->num_preserve].len = len;
+	job->num_preserve++;
+
+	return 0;
+}
+
 void usage(void)
 {
 	printf("ISP programmer for Nuvoton N76E003\n");
@@ -430,23 +1401,57 @@ void usage(void)
 	printf("                         comma separated values of sub-options:\n");
 	printf("                           rpd=0|1\n");
 	printf("  --aprom-file, -a       binary APROM file to flash\n");
+	printf("  --erase-all, -e        erase the whole APROM. Skipped when programming\n");
+	printf("                         with the stock LDROM, which already does it\n");
+	printf("  --addressed-ldrom, -L  the LDROM is a custom one, programming updates\n");
+	printf("                         at their start address and only erasing the\n");
+	printf("                         pages they cover. Needed by --preserve\n");
+	printf("  --preserve, -p         addr:len of an APROM range to never erase or\n");
+	printf("                         program, such as calibration data. Can be\n");
+	printf("                         repeated\n");
+	printf("  --reset-gpio, -R       GPIO line driving the reset pin, as\n");
+	printf("                         chip:line[:invert]. Active low by default\n");
+	printf("  --power-gpio, -P       GPIO line switching the board power, as\n");
+	printf("                         chip:line[:invert]. High means powered\n");
 	printf("  --remain-isp, -r       remain in ISP mode when exiting\n");
 	printf("  --read-serial, -s      read serial output after programming\n");
+	printf("  --dialog, -D           run a send/expect dialog file with the\n");
+	printf("                         firmware after programming\n");
+	printf("  --audit, -A            only read the identity and config of every\n");
+	printf("                         device given with -d, concurrently, and print\n");
+	printf("                         them as JSON. The devices are then rebooted,\n");
+	printf("                         unless --remain-isp is given\n");
+	printf("  --events, -E           send progress events as JSON datagrams to\n");
+	printf("                         that Unix socket\n");
+	printf("  --timeout, -t          connect timeout, in ms. Defaults to none, or\n");
+	printf("                         %d with --audit\n", AUDIT_CONNECT_TIMEOUT);
 }
 
 int main(int argc, char *argv[])
 {
+	struct job job = {
+		.connect_timeout = -1,
+	};
 	struct dev dev = {
+		.job = &job,
 		.serial_device = "/dev/ttyUSB0",
 	};
+	const char **serial_devices = NULL;
+	int num_serial_devices = 0;
+	const char *errmsg;
+	const char *name;
 	int rc;
 	int c;
 	bool has_config_opts = false;
+	bool config_changes = false;
+	union config_bytes config;
+	bool audit = false;
+	long start;
 
 	while (1) {
 		int option_index = 0;
 
-		c = getopt_long(argc, argv, "a:c:d:hrs",
+		c = getopt_long(argc, argv, "AD:E:LP:R:a:c:d:ehp:rst:",
 				long_options, &option_index);
 		if (c == -1)
 			break;
@@ -458,25 +1463,60 @@ int main(int argc, char *argv[])
 				printf(" with arg %s", optarg);
 			printf("\n");
 			break;
+		case 'A':
+			audit = true;
+			break;
+		case 'D':
+			job.dialog_file = optarg;
+			break;
+		case 'E':
+			rc = open_events(optarg);
+			if (rc)
+				errx(EXIT_FAILURE, "Can't open event socket %s: %s",
+				     optarg, strerror(-rc));
+			break;
+		case 'L':
+			job.addressed_ldrom = true;
+			break;
+		case 'P':
+			job.power_gpio = optarg;
+			break;
+		case 'R':
+			job.reset_gpio = optarg;
+			break;
 		case 'a':
-			dev.aprom_file = optarg;
+			job.aprom_file = optarg;
 			break;
 		case 'c':
-			if (process_config_options(&dev))
+			if (process_config_options(&job))
 				return EXIT_FAILURE;
 			has_config_opts = true;
 			break;
 		case 'd':
-			dev.serial_device = optarg;
+			serial_devices = realloc(serial_devices,
+						 (num_serial_devices + 1) * sizeof(*serial_devices));
+			if (serial_devices == NULL)
+				errx(EXIT_FAILURE, "Can't allocate memory");
+			serial_devices[num_serial_devices++] = optarg;
+			break;
+		case 'e':
+			job.erase_all = true;
 			break;
 		case 'h':
 			usage();
 			return EXIT_SUCCESS;
+		case 'p':
+			if (process_preserve_option(&job))
+				return EXIT_FAILURE;
+			break;
 		case 'r':
-			dev.remain_isp = true;
+			job.remain_isp = true;
 			break;
 		case 's':
-			dev.read_serial = true;
+			job.read_serial = true;
+			break;
+		case 't':
+			job.connect_timeout = atoi(optarg);
 			break;
                default:
 		       return EXIT_FAILURE;
@@ -486,57 +1526,124 @@ int main(int argc, char *argv[])
 	if (optind < argc)
 		errx(EXIT_FAILURE, "Extra argument: %s", argv[optind]);
 
-	open_serial_device(&dev);
+	if (audit) {
+		if (job.aprom_file || has_config_opts || job.erase_all ||
+		    job.num_preserve || job.read_serial || job.dialog_file)
+			errx(EXIT_FAILURE, "The audit mode is read-only");
 
-	dev.pkt_num = 0x17;		/* could be random */
+		if (num_serial_devices == 0) {
+			serial_devices = &dev.serial_device;
+			num_serial_devices = 1;
+		}
 
-	printf("Ready to connect\n");
+		if (job.connect_timeout == -1)
+			job.connect_timeout = AUDIT_CONNECT_TIMEOUT;
 
-	/* Try to automatically reset the device. Move DTR to low then
-	 * high. This will not work if DTR is not connected or the RPD
-	 * config bit is not set to 1. */
-	sp_set_dtr(dev.sp, SP_DTR_ON);
-	usleep(1000);
-	sp_set_dtr(dev.sp, SP_DTR_OFF);
+		rc = open_gpios(&job);
+		if (rc)
+			errx(EXIT_FAILURE, "Can't request GPIO lines: %s", strerror(-rc));
 
-	rc = dev_connect(&dev);
-	if (rc)
-		errx(EXIT_FAILURE, "Can't connect to device");
+		rc = run_audit(&job, serial_devices, num_serial_devices);
 
-	printf("Connected\n");
+		return rc ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
 
-	rc = dev_sync_packno(&dev);
-	if (rc)
-		errx(EXIT_FAILURE, "Can't sync packet numbers");
+	if (num_serial_devices > 1)
+		errx(EXIT_FAILURE, "Only one serial device can be used, except with --audit");
+	if (num_serial_devices == 1)
+		dev.serial_device = serial_devices[0];
+	free(serial_devices);
+
+	if (job.connect_timeout == -1)
+		job.connect_timeout = 0;
+
+	if (job.dialog_file) {
+		if (job.remain_isp)
+			errx(EXIT_FAILURE, "A dialog needs the firmware to run");
+
+		rc = load_dialog(&job);
+		if (rc)
+			errx(EXIT_FAILURE, "Can't load dialog file %s",
+			     job.dialog_file);
+	}
+
+	/* The stock ISP_UART0 LDROM erases the whole APROM on
+	 * CMD_UPDATE_APROM, and programs from address 0 whatever the
+	 * start address. Preserving a range needs a custom one. */
+	if (job.num_preserve && !job.addressed_ldrom)
+		errx(EXIT_FAILURE, "Preserved ranges need an LDROM supporting addressed updates (--addressed-ldrom)");
+
+	if (job.erase_all && job.num_preserve)
+		errx(EXIT_FAILURE, "Can't erase the whole APROM with preserved ranges");
+
+	if (job.aprom_file) {
+		rc = load_aprom_file(&job);
+		if (rc)
+			errx(EXIT_FAILURE, "Can't load APROM file %s: %s",
+			     job.aprom_file, strerror(-rc));
+
+		rc = plan_aprom_segments(&job);
+		if (rc)
+			errx(EXIT_FAILURE, "APROM file %s overwrites a preserved range",
+			     job.aprom_file);
+	}
 
-	rc = generic_command(&dev, CMD_GET_FWVER);
+	events.port = dev.serial_device;
+	atexit(event_exit);
+
+	event_phase("open");
+	start = now_ms();
+	rc = open_gpios(&job);
 	if (rc)
-		errx(EXIT_FAILURE, "Can't get FW version");
-	printf("FW version: 0x%x\n", dev.ack.get_fwver.version);
+		errx(EXIT_FAILURE, "Can't request GPIO lines: %s", strerror(-rc));
 
-	rc = generic_command(&dev, CMD_GET_DEVICEID);
+	rc = open_serial_device(&dev, &errmsg);
 	if (rc)
-		errx(EXIT_FAILURE, "Can't get device ID");
-	switch (dev.ack.get_deviceid.deviceid) {
-	case 0x3650: printf("Device is N76E003\n"); break;
-	default:
-		errx(EXIT_FAILURE, "Unknown device %x",
-		     dev.ack.get_deviceid.deviceid);
-		return -EOPNOTSUPP;
+		errx(EXIT_FAILURE, "%s %s", errmsg, dev.serial_device);
+	event_phase_done(start);
+
+	dev.pkt_num = 0x17;		/* could be random */
+
+	printf("Ready to connect\n");
+
+	event_phase("connect");
+	start = now_ms();
+
+	if (job.reset_gpio || job.power_gpio) {
+		rc = gpio_reset(&job);
+		if (rc)
+			errx(EXIT_FAILURE, "Can't reset through GPIOs: %s",
+			     strerror(-rc));
+	} else {
+		dev_pulse_dtr(&dev);
 	}
 
-	rc = generic_command(&dev, CMD_READ_CONFIG);
+	rc = dev_identify(&dev, &errmsg);
 	if (rc)
-		errx(EXIT_FAILURE, "Can't read config");
-	dev.config_current = dev.ack.read_config;
+		errx(EXIT_FAILURE, "%s", errmsg);
+
+	event_phase_done(start);
+	printf("Connected\n");
+	printf("FW version: 0x%x\n", dev.fwver);
+
+	name = device_name(dev.deviceid);
+	if (name == NULL)
+		errx(EXIT_FAILURE, "Unknown device %x", dev.deviceid);
+	printf("Device is %s\n", name);
 
 	decode_config(&dev.config_current);
-	dev.aprom_size = ldsize[dev.ack.read_config.ldsize].aprom_size * 1024;
+	dev.aprom_size = ldsize[dev.config_current.ldsize].aprom_size * 1024;
 
+	/* Config changes only take effect after a reset. Program them
+	 * last, so that the reboot to APROM applies everything at
+	 * once. LDSIZE can't be changed from the command line, so the
+	 * APROM size stays the one read above. Avoid programming the
+	 * config bits if nothing has changed. This is not an error. */
 	if (has_config_opts) {
-		rc = set_new_config_options(&dev);
-		if (rc)
-			errx(EXIT_FAILURE, "Can't set new config bits");
+		if (stage_config(&dev, &config))
+			config_changes = true;
+		else
+			printf("No config changes\n");
 	}
 
 	if (0) {
@@ -544,20 +1651,67 @@ int main(int argc, char *argv[])
 		dev_reset(&dev);
 	}
 
-	if (dev.aprom_file) {
-		printf("Flashing APROM with %s\n", dev.aprom_file);
+	/* The stock LDROM erases the whole APROM on CMD_UPDATE_APROM,
+	 * which makes a full erase redundant when programming. An
+	 * addressed LDROM only erases the pages it programs, and would
+	 * leave the tail of an older, larger firmware behind. */
+	if (job.erase_all && job.aprom_file && !job.addressed_ldrom) {
+		printf("Skipping full erase, programming erases the whole APROM\n");
+	} else if (job.erase_all) {
+		event_phase("erase");
+		start = now_ms();
+		rc = dev_erase_all(&dev);
+		if (rc)
+			errx(EXIT_FAILURE, "Can't erase APROM");
+		event_phase_done(start);
+		printf("APROM erased in %ld ms\n", now_ms() - start);
+	}
+
+	if (job.aprom_file) {
+		printf("Flashing APROM with %s\n", job.aprom_file);
+		event_phase("flash");
+		start = now_ms();
 		rc = dev_update_aprom(&dev);
 		if (rc)
 			errx(EXIT_FAILURE, "Can't program APROM");
-		printf("Done\n");
+		event_phase_done(start);
+		printf("Done in %ld ms\n", now_ms() - start);
+		unload_aprom_file(&job);
+	}
+
+	if (config_changes) {
+		event_phase("config");
+		start = now_ms();
+		rc = set_new_config_options(&dev, &config);
+		if (rc)
+			errx(EXIT_FAILURE, "Can't set new config bits");
+		event_phase_done(start);
 	}
 
-	if (!dev.remain_isp) {
+	if (!job.remain_isp) {
 		printf("Rebooting to APROM\n");
+		event_phase("run");
+		start = now_ms();
 		dev_run_aprom(&dev);
+		event_phase_done(start);
+	} else if (config_changes) {
+		printf("The new config will take effect after the next reset\n");
+	}
+
+	if (job.dialog_file) {
+		event_phase("dialog");
+		start = now_ms();
+		rc = run_dialog(&dev);
+		if (rc)
+			errx(EXIT_FAILURE, "Dialog failed");
+		event_phase_done(start);
+		printf("Dialog done\n");
 	}
 
-	if (dev.read_serial) {
+	event_verdict(dev.serial_device, true, NULL);
+	events.verdict = true;
+
+	if (job.read_serial) {
 		char buf[500];
 
 		while (1) {
@@ -122,26 +122,87 @@ struct pkt_ack {
 _Static_assert(sizeof(struct pkt_cmd) == 64, "bad packet size");
 _Static_assert(sizeof(struct pkt_ack) == 64, "bad ack size");
 
+/* Flash page size. This is the erase granularity. */
+#define FLASH_PAGE_SIZE 128
+
+/* Largest APROM (LDSIZE=7), in bytes */
+#define APROM_MAX (18 * 1024)
+
+/* Maximum number of preserved ranges in APROM */
+#define MAX_PRESERVE 8
+
 /* Some chip config bits */
 enum {
 	OPT_RPD,
 };
 
-/* Device state */
-struct dev {
-	const char *serial_device;
-	struct sp_port *sp;
-	uint32_t pkt_num;	 /* next packet number, for command and ack */
-	uint32_t checksum;	 /* checksum of last sent command */
-	struct pkt_ack ack;	 /* last response */
-	int aprom_size;		 /* APROM size, in bytes */
+/* Steps of a dialog with the firmware, once programmed */
+enum {
+	STEP_SEND,
+	STEP_EXPECT,
+	STEP_TIMEOUT,
+	STEP_WAIT,
+};
+
+struct dialog_step {
+	int type;
+	int line;		/* in the dialog file */
+	int value;		/* timeout or wait, in ms */
+	int len;
+	char *text;		/* to send or expect */
+};
+
+/* What to do with the devices: the options, and the image and
+ * dialog prepared from them. Read-only once the devices are
+ * connected, so it is shared by all the sessions. */
+struct job {
+	int connect_timeout;	 /* in ms, 0 to wait forever */
 	const char *aprom_file;	 /* Binary file to program */
+	const uint8_t *aprom;	 /* and its content */
+	int aprom_len;
+
+	/* APROM ranges to leave untouched, such as calibration data,
+	 * and the segments of the file programmed around them. */
+	struct {
+		int addr;
+		int len;
+	} preserve[MAX_PRESERVE], segments[MAX_PRESERVE + 1];
+	int num_preserve;
+	int num_segments;
+	bool addressed_ldrom;	 /* LDROM honors the update start address */
+	bool erase_all;		 /* Erase the whole APROM before programming */
+
+	/* Optional GPIO lines driving the board reset and power, as
+	 * chip:line[:invert], and their line request fds. */
+	const char *reset_gpio;
+	const char *power_gpio;
+	int reset_fd;
+	int power_fd;
+
 	bool remain_isp;	 /* Remain in ISP mode upon exiting */
 	bool read_serial;	 /* Read from serial line after programming */
+	const char *dialog_file; /* Dialog to run after programming */
+	struct dialog_step *dialog;
+	int num_dialog_steps;
 
-	/* Current config bits, and config bits set by the command
-	 * line, if any. */
-	union config_bytes config_current;
+	/* Config bits set by the command line, if any */
 	union config_bytes config_new;
 	union config_bytes config_mask;
 };
+
+/* Device state. Only what a session with one device needs, so that
+ * many of them can be driven at once. Responses are read into local
+ * buffers, and only the values needed are kept here. */
+struct dev {
+	const struct job *job;
+	const char *serial_device;
+	struct sp_port *sp;
+	uint32_t pkt_num;	 /* next packet number, for command and ack */
+	uint32_t checksum;	 /* checksum of last sent command */
+	uint32_t deviceid;
+	uint8_t fwver;		 /* LDROM firmware version */
+	union config_bytes config_current; /* Current config bits */
+	int aprom_size;		 /* APROM size, in bytes */
+};
+
+_Static_assert(sizeof(struct dev) <= 64, "device state larger than a cache line");
@@ -0,0 +1,562 @@
+/*
+ * nvtispsim - simulate many Nuvoton N76E003 ISP boards on ptys
+ * Copyright 2021 Frank Zago
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <errno.h>
+#include <err.h>
+#include <sys/resource.h>
+
+#include "nvtispflash.h"
+
+/* Values returned by the simulated LDROM */
+#define SIM_FWVER    0x27
+#define SIM_DEVICEID 0x3650
+
+/* Board state */
+enum {
+	BOARD_ABSENT,		/* not inserted yet */
+	BOARD_BOOT,		/* LDROM waiting for a connect packet */
+	BOARD_ISP,		/* LDROM connected, processing commands */
+	BOARD_APROM,		/* running the firmware */
+};
+
+/* Per board state. Everything needed by the protocol, and no more,
+ * so that a large number of boards can be simulated. */
+struct board {
+	int fd;			 /* pty master */
+	int slave_fd;		 /* kept open so the master never hangs up */
+	uint8_t state;
+	uint8_t rx_len;		 /* bytes of the current packet received */
+	bool tx_pending;	 /* an ack is waiting for its latency delay */
+	union config_bytes config;
+	uint32_t pkt_num;	 /* packet number of the last ack */
+	uint32_t addr;		 /* APROM update cursor */
+	uint32_t remaining;	 /* APROM update bytes left */
+	uint64_t deadline;	 /* insertion, boot window end, or ack time */
+	uint8_t *aprom;		 /* slice of the shared APROM array */
+	struct pkt_cmd rx;
+	struct pkt_ack tx;
+};
+
+/* Timing and fault model, shared by all boards */
+static struct {
+	unsigned int latency_ms;    /* delay before an ack is sent */
+	unsigned int boot_window_ms; /* time the LDROM waits for a connect */
+	unsigned int stagger_ms;    /* delay between two board insertions */
+	unsigned int drop_pct;	    /* percentage of acks lost */
+	bool addressed;		    /* custom LDROM, see CMD_UPDATE_APROM */
+} model;
+
+static volatile sig_atomic_t reset_all;
+static volatile sig_atomic_t done;
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void sig_reset(int sig)
+{
+	reset_all = 1;
+}
+
+static void sig_done(int sig)
+{
+	done = 1;
+}
+
+/* Power up or reset a board. The LDROM starts and waits for a connect
+ * packet. */
+static void board_reset(struct board *b, uint64_t now)
+{
+	b->state = BOARD_BOOT;
+	b->rx_len = 0;
+	b->tx_pending = false;
+	b->remaining = 0;
+	b->deadline = model.boot_window_ms ? now + model.boot_window_ms : 0;
+}
+
+static void board_update_aprom(struct board *b, const uint8_t *data, uint32_t len)
+{
+	if (len > b->remaining)
+		len = b->remaining;
+	if (b->addr + len > APROM_MAX)
+		len = b->addr < APROM_MAX ? APROM_MAX - b->addr : 0;
+
+	memcpy(&b->aprom[b->addr], data, len);
+	b->addr += len;
+	b->remaining -= len;
+}
+
+/* Process a complete command packet, and queue the ack if there is
+ * one. */
+static void board_process(struct board *b, uint64_t now)
+{
+	const struct pkt_cmd *cmd = &b->rx;
+	const uint8_t *p = (const uint8_t *)cmd;
+	uint32_t checksum = 0;
+	uint32_t start;
+	uint32_t end;
+	int i;
+
+	if (b->state == BOARD_BOOT) {
+		if (cmd->cmd != CMD_CONNECT)
+			return;
+		b->state = BOARD_ISP;
+	}
+
+	for (i = 0; i < sizeof(*cmd); i++)
+		checksum += p[i];
+
+	memset(&b->tx, 0, sizeof(b->tx));
+
+	switch (cmd->cmd) {
+	case CMD_GET_FWVER:
+		b->tx.get_fwver.version = SIM_FWVER;
+		break;
+
+	case CMD_GET_DEVICEID:
+		b->tx.get_deviceid.deviceid = SIM_DEVICEID;
+		break;
+
+	case CMD_READ_CONFIG:
+		b->tx.read_config = b->config;
+		break;
+
+	case CMD_UPDATE_CONFIG:
+		b->config = cmd->update_config.new;
+		break;
+
+	case CMD_ERASE_ALL:
+		memset(b->aprom, 0xff, APROM_MAX);
+		break;
+
+	case CMD_UPDATE_APROM:
+		/* The stock ISP_UART0 LDROM erases the whole APROM, and
+		 * programs from address 0 whatever the start address. */
+		if (!model.addressed) {
+			memset(b->aprom, 0xff, APROM_MAX);
+			b->addr = 0;
+			b->remaining = cmd->update_aprom.total_length;
+			board_update_aprom(b, cmd->update_aprom.data,
+					   sizeof(cmd->update_aprom.data));
+			break;
+		}
+
+		/* A custom LDROM may only erase the pages covered by the
+		 * update, and program it at its start address. */
+		start = cmd->update_aprom.start_addr;
+		end = start + cmd->update_aprom.total_length;
+		if (start > APROM_MAX)
+			start = APROM_MAX;
+		if (end > APROM_MAX)
+			end = APROM_MAX;
+		start &= ~(FLASH_PAGE_SIZE - 1);
+		end = (end + FLASH_PAGE_SIZE - 1) & ~(FLASH_PAGE_SIZE - 1);
+		if (end > start)
+			memset(&b->aprom[start], 0xff, end - start);
+
+		b->addr = cmd->update_aprom.start_addr;
+		b->remaining = cmd->update_aprom.total_length;
+		board_update_aprom(b, cmd->update_aprom.data,
+				   sizeof(cmd->update_aprom.data));
+		break;
+
+	case CMD_RUN_APROM:
+		b->state = BOARD_APROM;
+		return;
+
+	case CMD_RESET:
+		board_reset(b, now);
+		return;
+
+	case 0:
+		/* Continuation of an APROM update */
+		if (b->remaining)
+			board_update_aprom(b, cmd->update_aprom2.data,
+					   sizeof(cmd->update_aprom2.data));
+		break;
+
+	default:
+		break;
+	}
+
+	b->pkt_num = cmd->pkt_num + 1;
+	b->tx.checksum = checksum;
+	b->tx.pkt_num = b->pkt_num;
+
+	if (model.drop_pct && rand() % 100 < model.drop_pct)
+		return;
+
+	b->tx_pending = true;
+	b->deadline = now + model.latency_ms;
+}
+
+static void board_send(struct board *b)
+{
+	b->tx_pending = false;
+	b->deadline = 0;
+
+	if (write(b->fd, &b->tx, sizeof(b->tx)) != sizeof(b->tx))
+		warn("Can't send ack");
+}
+
+static void board_input(struct board *b, uint64_t now)
+{
+	uint8_t buf[256];
+	ssize_t len;
+	ssize_t i;
+
+	len = read(b->fd, buf, sizeof(buf));
+	if (len <= 0)
+		return;
+
+	if (b->state == BOARD_ABSENT)
+		return;
+
+	for (i = 0; i < len; i++) {
+		/* The simulated firmware echoes everything back. The
+		 * state may change in the middle of the buffer, after a
+		 * CMD_RUN_APROM. */
+		if (b->state == BOARD_APROM) {
+			if (write(b->fd, &buf[i], len - i) != len - i)
+				warn("Can't echo");
+			return;
+		}
+
+		((uint8_t *)&b->rx)[b->rx_len++] = buf[i];
+		if (b->rx_len < sizeof(b->rx))
+			continue;
+
+		b->rx_len = 0;
+
+		/* The device is still busy with the previous
+		 * command. Drop that one. */
+		if (b->tx_pending)
+			continue;
+
+		board_process(b, now);
+	}
+}
+
+/* Handle all the timers of a board. Return the next deadline, or 0. */
+static uint64_t board_timers(struct board *b, uint64_t now)
+{
+	if (b->deadline == 0 || b->deadline > now)
+		return b->deadline;
+
+	switch (b->state) {
+	case BOARD_ABSENT:
+		board_reset(b, now);
+		break;
+
+	case BOARD_BOOT:
+		/* Nobody connected. Boot the firmware. */
+		b->state = BOARD_APROM;
+		b->deadline = 0;
+		break;
+
+	case BOARD_ISP:
+		if (b->tx_pending)
+			board_send(b);
+		else
+			b->deadline = 0;
+		break;
+	}
+
+	return b->deadline;
+}
+
+static void open_board(struct board *b, const char *link)
+{
+	struct termios tio;
+	const char *name;
+
+	b->fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (b->fd == -1)
+		err(EXIT_FAILURE, "Can't allocate a pty");
+
+	if (grantpt(b->fd) || unlockpt(b->fd))
+		err(EXIT_FAILURE, "Can't unlock pty");
+
+	name = ptsname(b->fd);
+	if (name == NULL)
+		err(EXIT_FAILURE, "Can't get pty name");
+
+	b->slave_fd = open(name, O_RDWR | O_NOCTTY);
+	if (b->slave_fd == -1)
+		err(EXIT_FAILURE, "Can't open %s", name);
+
+	if (tcgetattr(b->slave_fd, &tio) == 0) {
+		cfmakeraw(&tio);
+		tcsetattr(b->slave_fd, TCSANOW, &tio);
+	}
+
+	if (link) {
+		unlink(link);
+		if (symlink(name, link))
+			err(EXIT_FAILURE, "Can't create link %s", link);
+		printf("%s -> %s\n", link, name);
+	} else {
+		printf("%s\n", name);
+	}
+}
+
+/* Make sure there are enough file descriptors for 2 per board. */
+static void raise_fd_limit(int num_boards)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl))
+		return;
+
+	if (rl.rlim_cur >= 2 * num_boards + 16)
+		return;
+
+	rl.rlim_cur = rl.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &rl) || rl.rlim_cur < 2 * num_boards + 16)
+		errx(EXIT_FAILURE, "Too many boards for the file descriptor limit");
+}
+
+static const struct option long_options[] = {
+	{ "boards", required_argument, 0,  'n' },
+	{ "link-prefix", required_argument, 0,  'p' },
+	{ "latency", required_argument, 0,  'l' },
+	{ "boot-window", required_argument, 0,  'w' },
+	{ "stagger", required_argument, 0,  's' },
+	{ "drop", required_argument, 0,  'f' },
+	{ "addressed-ldrom", no_argument, 0,  'L' },
+	{ "help", no_argument, 0,  'h' },
+	{ 0, 0, 0, 0 }
+};
+
+void usage(void)
+{
+	printf("Simulator of Nuvoton N76E003 boards with the ISP LDROM\n");
+	printf("Options:\n");
+	printf("  --boards, -n           number of boards to simulate. Defaults to 1\n");
+	printf("  --link-prefix, -p      create symlinks <prefix>0, <prefix>1, ... to the ptys\n");
+	printf("  --latency, -l          delay before each ack, in ms\n");
+	printf("  --boot-window, -w      time the LDROM waits for a connect, in ms.\n");
+	printf("                         Defaults to 0, waiting forever\n");
+	printf("  --stagger, -s          delay between board insertions, in ms\n");
+	printf("  --drop, -f             percentage of acks lost\n");
+	printf("  --addressed-ldrom, -L  simulate a custom LDROM programming updates at\n");
+	printf("                         their start address, and only erasing the pages\n");
+	printf("                         they cover\n");
+	printf("Send SIGUSR1 to reset all the boards at once.\n");
+}
+
+int main(int argc, char *argv[])
+{
+	const char *link_prefix = NULL;
+	struct board *boards;
+	struct pollfd *pfds;
+	sigset_t blocked;
+	sigset_t unblocked;
+	uint8_t *aprom;
+	int num_boards = 1;
+	uint64_t now;
+	int c;
+	int i;
+
+	while (1) {
+		int option_index = 0;
+
+		c = getopt_long(argc, argv, "Lf:hl:n:p:s:w:",
+				long_options, &option_index);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'L':
+			model.addressed = true;
+			break;
+		case 'f':
+			model.drop_pct = atoi(optarg);
+			break;
+		case 'h':
+			usage();
+			return EXIT_SUCCESS;
+		case 'l':
+			model.latency_ms = atoi(optarg);
+			break;
+		case 'n':
+			num_boards = atoi(optarg);
+			break;
+		case 'p':
+			link_prefix = optarg;
+			break;
+		case 's':
+			model.stagger_ms = atoi(optarg);
+			break;
+		case 'w':
+			model.boot_window_ms = atoi(optarg);
+			break;
+		default:
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind < argc)
+		errx(EXIT_FAILURE, "Extra argument: %s", argv[optind]);
+
+	if (num_boards <= 0)
+		errx(EXIT_FAILURE, "Invalid number of boards");
+
+	raise_fd_limit(num_boards);
+
+	boards = calloc(num_boards, sizeof(*boards));
+	pfds = calloc(num_boards, sizeof(*pfds));
+	aprom = malloc((size_t)num_boards * APROM_MAX);
+	if (boards == NULL || pfds == NULL || aprom == NULL)
+		errx(EXIT_FAILURE, "Can't allocate %d boards", num_boards);
+
+	memset(aprom, 0xff, (size_t)num_boards * APROM_MAX);
+
+	now = now_ms();
+
+	for (i = 0; i < num_boards; i++) {
+		struct board *b = &boards[i];
+		char link[256];
+
+		if (link_prefix)
+			snprintf(link, sizeof(link), "%s%d", link_prefix, i);
+		open_board(b, link_prefix ? link : NULL);
+
+		b->aprom = &aprom[(size_t)i * APROM_MAX];
+
+		/* Factory config: boot from LDROM=4K, RPD=0 */
+		memset(b->config.raw, 0xff, sizeof(b->config.raw));
+		b->config.rpd = 0;
+		b->config.ocden = 0;
+		b->config.cbs = 0;
+		b->config.ldsize = 0;
+
+		b->state = BOARD_ABSENT;
+		b->deadline = now + (uint64_t)i * model.stagger_ms;
+
+		pfds[i].fd = b->fd;
+		pfds[i].events = POLLIN;
+	}
+
+	fflush(stdout);
+
+	signal(SIGUSR1, sig_reset);
+	signal(SIGINT, sig_done);
+	signal(SIGTERM, sig_done);
+
+	/* The signals are only delivered while waiting in ppoll(), so
+	 * that one arriving after the flags are checked still wakes it
+	 * up. */
+	sigemptyset(&blocked);
+	sigaddset(&blocked, SIGUSR1);
+	sigaddset(&blocked, SIGINT);
+	sigaddset(&blocked, SIGTERM);
+	sigprocmask(SIG_BLOCK, &blocked, &unblocked);
+
+	while (!done) {
+		struct timespec ts;
+		uint64_t next = 0;
+		int rc;
+
+		now = now_ms();
+
+		if (reset_all) {
+			reset_all = 0;
+			for (i = 0; i < num_boards; i++)
+				if (boards[i].state != BOARD_ABSENT)
+					board_reset(&boards[i], now);
+		}
+
+		for (i = 0; i < num_boards; i++) {
+			uint64_t deadline = board_timers(&boards[i], now);
+
+			if (deadline && (next == 0 || deadline < next))
+				next = deadline;
+		}
+
+		if (next > now) {
+			ts.tv_sec = (next - now) / 1000;
+			ts.tv_nsec = (next - now) % 1000 * 1000000;
+		} else {
+			ts.tv_sec = 0;
+			ts.tv_nsec = 0;
+		}
+
+		rc = ppoll(pfds, num_boards, next ? &ts : NULL, &unblocked);
+		if (rc == -1) {
+			if (errno == EINTR)
+				continue;
+			err(EXIT_FAILURE, "ppoll failed");
+		}
+
+		now = now_ms();
+
+		for (i = 0; i < num_boards && rc; i++) {
+			if (pfds[i].revents == 0)
+				continue;
+			rc--;
+			board_input(&boards[i], now);
+		}
+	}
+
+	for (i = 0; i < num_boards; i++) {
+		if (link_prefix) {
+			char link[256];
+
+			snprintf(link, sizeof(link), "%s%d", link_prefix, i);
+			unlink(link);
+		}
+		close(boards[i].slave_fd);
+		close(boards[i].fd);
+	}
+
+	free(aprom);
+	free(pfds);
+	free(boards);
+
+	return 0;
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-file-style: "linux"
+ * indent-tabs-mode: t
+ * tab-width: 8
+ * End:
+ */